@@ -0,0 +1,66 @@
+/* Times te_eval_batch under each instruction set te_set_batch_isa
+ * accepts, in millions of rows per second. Build with
+ *   cc -O2 -DTE_SIMD bench_batch.c tinyexpr.c -lm
+ * Instruction sets the host lacks are shown as -.
+ */
+#include "tinyexpr.h"
+#include <stdio.h>
+#include <time.h>
+
+#define ROWS 4096
+#define LOOPS 200
+#define REPEAT 5
+
+static const char *const formulas[] = {
+    "x+y", "x*y+z", "(x-y)/(z+1)", "x*x*x+2*x*y-3*z", "sqrt(x*x+y*y)",
+    "exp(-x)*z", "ln(x+1)+log10(y+1)", "sin(x)*cos(y)", "pow(x+1,z)"
+};
+
+static const char *const isas[] = {"scalar", "sse2", "avx2", "avx512"};
+
+static double x, y, z;
+static double xs[ROWS], ys[ROWS], zs[ROWS], out[ROWS];
+
+int main(void) {
+    te_variable vars[] = {{"x", &x}, {"y", &y}, {"z", &z}};
+    const double *columns[3];
+    int f, isa, r, k, error, best = te_batch_isa();
+
+    columns[0] = xs; columns[1] = ys; columns[2] = zs;
+    for (k = 0; k < ROWS; ++k) {
+        xs[k] = k * 1e-3;
+        ys[k] = 2 - k * 1e-4;
+        zs[k] = 0.5 + (k % 7) * 0.25;
+    }
+
+    printf("%d rows, million rows per second (best of %d)\n", ROWS, REPEAT);
+    printf("%-22s", "");
+    for (isa = TE_ISA_SCALAR; isa <= TE_ISA_AVX512; ++isa) printf(" %8s", isas[isa]);
+    printf("\n");
+    for (f = 0; f < (int)(sizeof(formulas) / sizeof(formulas[0])); ++f) {
+        te_expr *n = te_compile(formulas[f], vars, 3, &error);
+
+        if (!n) return 1;
+        printf("%-22s", formulas[f]);
+        for (isa = TE_ISA_SCALAR; isa <= TE_ISA_AVX512; ++isa) {
+            double t = 0, s;
+            clock_t start;
+
+            if (te_set_batch_isa(isa) != isa) {
+                printf(" %8s", "-");
+                continue;
+            }
+            for (r = 0; r < REPEAT; ++r) {
+                start = clock();
+                for (k = 0; k < LOOPS; ++k) te_eval_batch(n, columns, ROWS, out);
+                s = (double)(clock() - start) / CLOCKS_PER_SEC;
+                if (!r || s < t) t = s;
+            }
+            printf(" %8.1f", t > 0 ? (double)ROWS * LOOPS / t * 1e-6 : 0.0);
+        }
+        printf("\n");
+        te_free(n);
+    }
+    te_set_batch_isa(best);
+    return 0;
+}
@@ -0,0 +1,86 @@
+/* Times te_eval, programs and te_eval_batch on a generated sum of
+ * c*v terms over three variables, as parsed and after te_optimize with
+ * TE_OPT_CHAIN and TE_OPT_CHAIN | TE_OPT_STRICT. Build with
+ *   cc -O2 bench_chain.c tinyexpr.c -lm
+ * and pass the number of terms, 10000 by default.
+ */
+#include "tinyexpr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ROWS 1000
+#define REPEAT 5
+
+static const struct {const char *name; int flags;} modes[] = {
+    {"as parsed", 0},
+    {"CHAIN", TE_OPT_CHAIN},
+    {"CHAIN|STRICT", TE_OPT_CHAIN | TE_OPT_STRICT},
+};
+
+static double a, b, c;
+static double as[ROWS], bs[ROWS], cs[ROWS], out[ROWS];
+
+static double seconds(clock_t start) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char *argv[]) {
+    int terms = argc > 1 ? atoi(argv[1]) : 10000, loops, m, r, k, error;
+    char *text = malloc(24 * (size_t)(terms > 0 ? terms : 1) + 1), *p = text;
+    const double *columns[3];
+    te_variable vars[3];
+    double parsed = 0;
+
+    vars[0].name = "a"; vars[0].address = &a; vars[0].type = TE_VARIABLE; vars[0].context = 0;
+    vars[1].name = "b"; vars[1].address = &b; vars[1].type = TE_VARIABLE; vars[1].context = 0;
+    vars[2].name = "c"; vars[2].address = &c; vars[2].type = TE_VARIABLE; vars[2].context = 0;
+    columns[0] = as; columns[1] = bs; columns[2] = cs;
+    for (k = 0; k < ROWS; ++k) {
+        as[k] = k * 1e-3;
+        bs[k] = 1 - k * 1e-3;
+        cs[k] = 0.5;
+    }
+    if (!text || terms < 1) return 1;
+    for (k = 0; k < terms; ++k) p += sprintf(p, "%s%c*%d", k ? "+" : "", "abc"[k % 3], k + 1);
+    loops = 2000000 / terms + 1;
+
+    printf("%d terms, us per evaluation (best of %d)\n", terms, REPEAT);
+    printf("%-14s %10s %10s %10s %10s\n", "", "optimize", "te_eval", "program", "batch/row");
+    for (m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); ++m) {
+        te_expr *n = te_compile(text, vars, 3, &error);
+        te_program *program;
+        double t[4], s, sum;
+        clock_t start;
+
+        if (!n) return 1;
+        start = clock();
+        n = te_optimize(n, modes[m].flags, 0);
+        t[0] = seconds(start) * 1e6;
+        program = te_program_compile(n);
+        t[1] = t[2] = t[3] = 0;
+        for (r = 0; r < REPEAT; ++r) {
+            start = clock();
+            for (k = 0, sum = 0; k < loops; ++k) {a = k * 1e-3; b = 1; c = 0.5; sum += te_eval(n);}
+            s = seconds(start) * 1e6 / loops;
+            if (!r || s < t[1]) t[1] = s;
+            if (!m && !r) parsed = sum;
+            if (modes[m].flags & TE_OPT_STRICT && !r && sum != parsed) printf("STRICT changed the result\n");
+
+            start = clock();
+            for (k = 0; program && k < loops; ++k) {a = k * 1e-3; sum += te_program_eval(program);}
+            s = seconds(start) * 1e6 / loops;
+            if (!r || s < t[2]) t[2] = s;
+
+            start = clock();
+            for (k = 0; k < loops / 10 + 1; ++k) te_eval_batch(n, columns, ROWS, out);
+            s = seconds(start) * 1e6 / (loops / 10 + 1) / ROWS;
+            if (!r || s < t[3]) t[3] = s;
+        }
+        printf("%-14s %10.0f %10.1f %10.1f %10.2f\n", modes[m].name, t[0], t[1], t[2], t[3]);
+        te_program_free(program);
+        te_free(n);
+    }
+    free(text);
+    return 0;
+}
@@ -0,0 +1,108 @@
+/* Times te_eval round-robin over 100k resident expressions, first as
+ * compiled with malloc and then after te_compact. The trees are compiled
+ * interleaved with as many others that are then freed, so their nodes are
+ * scattered as in a long-running process. Build with
+ *   cc -O2 bench_compact.c tinyexpr.c -lm
+ * and pass the number of expressions, 100000 by default.
+ */
+#include "tinyexpr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TEXT 1024
+#define PASSES 5
+#define REPEAT 3
+
+static const char *const unary[] = {"abs", "cos", "exp", "sqrt"};
+static const char *const operators = "+-*/";
+
+static double x, y, z;
+
+static unsigned long seed;
+
+static int pick(int n) {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return (int)((seed >> 33) % (unsigned long)n);
+}
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof(a[0])))
+
+/* Appends a random expression of at most depth levels to s. */
+static void generate(char *s, int depth) {
+    s += strlen(s);
+    if (depth <= 0 || pick(5) == 0) {
+        if (pick(3)) sprintf(s, "%c", "xyz"[pick(3)]);
+        else sprintf(s, "%d", 1 + pick(9));
+        return;
+    }
+    if (pick(4)) {
+        strcat(s, "(");
+        generate(s, depth - 1);
+        sprintf(s + strlen(s), "%c", operators[pick(4)]);
+        generate(s, depth - 1);
+        strcat(s, ")");
+    } else {
+        sprintf(s, "%s(", unary[pick(COUNT(unary))]);
+        generate(s, depth - 1);
+        strcat(s, ")");
+    }
+}
+
+/* Returns the best ns per te_eval over PASSES round-robin passes. */
+static double time_round_robin(te_expr **exprs, int count, double *sum) {
+    double best = 0, s;
+    clock_t start;
+    int r, p, i;
+
+    for (r = 0; r < REPEAT; ++r) {
+        *sum = 0;
+        start = clock();
+        for (p = 0; p < PASSES; ++p) {
+            x = p * 0.25;
+            for (i = 0; i < count; ++i) *sum += te_eval(exprs[i]);
+        }
+        s = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / ((double)PASSES * count);
+        if (!r || s < best) best = s;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    te_variable vars[] = {{"x", &x}, {"y", &y}, {"z", &z}};
+    int count = argc > 1 ? atoi(argv[1]) : 100000, i, error;
+    te_expr **exprs, *scrap, *c;
+    char text[TEXT];
+    double malloced, compacted, a, b;
+    size_t bytes = 0;
+
+    if (count < 1 || !(exprs = malloc(sizeof(te_expr*) * count))) return 1;
+    y = 1.5;
+    z = 0.5;
+    seed = 1;
+    for (i = 0; i < count; ++i) {
+        text[0] = '\0';
+        generate(text, 5);
+        if (!(exprs[i] = te_compile(text, vars, 3, &error))) return 1;
+        text[0] = '\0';
+        generate(text, 5);
+        if ((scrap = te_compile(text, vars, 3, &error))) te_free(scrap);
+        bytes += te_node_bytes(exprs[i]);
+    }
+
+    malloced = time_round_robin(exprs, count, &a);
+    for (i = 0; i < count; ++i) {
+        if ((c = te_compact(exprs[i]))) exprs[i] = c;
+    }
+    compacted = time_round_robin(exprs, count, &b);
+
+    printf("%d expressions, %.1f MB of nodes, ns per te_eval (best of %d)\n",
+            count, bytes / 1048576.0, REPEAT);
+    printf("%-10s %8.1f\n%-10s %8.1f\n", "malloc", malloced, "te_compact", compacted);
+    if (a != b && (a == a || b == b)) printf("results differ: %.17g, %.17g\n", a, b);
+
+    for (i = 0; i < count; ++i) te_free(exprs[i]);
+    free(exprs);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/* Times next_token over a generated formula text of several megabytes,
+ * in MB per second, once with 6-10 digit constants and once with a sixth
+ * of them at 17 digits, which go to strtod. next_token is internal, so
+ * this includes the library source; build with
+ *   cc -O2 bench_lexer.c -lm
+ * and pass the text size in MB, 8 by default.
+ */
+#include "tinyexpr.c"
+#include <time.h>
+
+#define REPEAT 5
+
+static const char *const names[] = {"price", "qty", "rate", "t", "vol", "strike", "x", "y"};
+static const char *const calls[] = {"log10", "exp", "sqrt", "abs", "ln", "sin", "cos", "floor"};
+static const char *const infix = "+-*/^";
+
+static double values[8];
+
+static unsigned long seed;
+
+static int pick(int n) {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return (int)((seed >> 33) % (unsigned long)n);
+}
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof(a[0])))
+
+/* Appends a constant of digits significant digits to p. */
+static char *number(char *p, int digits) {
+    int point = 1 + pick(digits), i;
+
+    for (i = 0; i < digits; ++i) {
+        if (i == point) *p++ = '.';
+        *p++ = (char)('0' + (i ? pick(10) : 1 + pick(9)));
+    }
+    return p;
+}
+
+/* Appends a random formula of at most depth more levels to p. */
+static char *generate(char *p, int depth, int wide) {
+    int r = pick(100);
+
+    if (depth <= 0 || r < 30) {
+        if (pick(10) < 6) return p + sprintf(p, "%s", names[pick(COUNT(names))]);
+        return number(p, wide && pick(6) == 0 ? 17 : 6 + pick(5));
+    }
+    if (r < 70) {
+        p = generate(p, depth - 1, wide);
+        *p++ = infix[pick(5)];
+        return generate(p, depth - 1, wide);
+    }
+    if (r < 85) p += sprintf(p, "%s", calls[pick(COUNT(calls))]);
+    else if (r < 93) p += sprintf(p, "pow(");
+    *p++ = '(';
+    p = generate(p, depth - 1, wide);
+    if (r >= 85 && r < 93) {
+        *p++ = ',';
+        p = generate(p, depth - 1, wide);
+        *p++ = ')';
+    }
+    *p++ = ')';
+    return p;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : 8) << 20, len;
+    char *text = malloc(size + 4096), *p;
+    te_variable vars[COUNT(names)];
+    int wide, r, i;
+
+    if (!text || !size) return 1;
+    for (i = 0; i < COUNT(names); ++i) {
+        vars[i].name = names[i];
+        vars[i].address = values + i;
+        vars[i].type = TE_VARIABLE;
+        vars[i].context = 0;
+    }
+
+    for (wide = 0; wide < 2; ++wide) {
+        unsigned long tokens = 0, errors = 0;
+        double best = 0, seconds, sum = 0;
+        clock_t start;
+        state s;
+
+        seed = 5;
+        for (p = text; (size_t)(p - text) < size; *p++ = '\n') p = generate(p, 6, wide);
+        len = (size_t)(p - text);
+
+        for (r = 0; r < REPEAT; ++r) {
+            s.start = s.next = text;
+            s.end = text + len;
+            s.lookup = vars;
+            s.lookup_len = COUNT(vars);
+            s.env = 0;
+            tokens = errors = 0;
+            start = clock();
+            for (next_token(&s); s.type != TOK_END; next_token(&s)) {
+                if (s.type == TOK_NUMBER) sum += s.value;
+                else if (s.type == TOK_ERROR) ++errors;
+                ++tokens;
+            }
+            seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+            if (!r || seconds < best) best = seconds;
+        }
+        printf("%s constants: %.1f MB, %lu tokens, %.0f MB/s (best of %d)%s\n",
+                wide ? "1 in 6 17-digit" : "6-10 digit", len / 1048576.0, tokens,
+                best > 0 ? len / 1048576.0 / best : 0.0, REPEAT, errors || sum != sum ? ", errors" : "");
+    }
+    free(text);
+    return 0;
+}
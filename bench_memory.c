@@ -0,0 +1,94 @@
+/* Compares the node memory of compiled trees, te_node_bytes, with that of
+ * the same expressions packed, te_packed_size, on a generated corpus,
+ * grouped by size. Build with
+ *   cc -O2 bench_memory.c tinyexpr.c -lm
+ * and pass the number of expressions, 10000 by default.
+ */
+#include "tinyexpr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEXT 16384
+#define DEPTHS 4
+
+static const char *const unary[] = {"abs", "cos", "exp", "ln", "sin", "sqrt"};
+static const char *const operators = "+-*/^";
+
+static double x, y, z;
+
+static unsigned long seed;
+
+static int pick(int n) {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return (int)((seed >> 33) % (unsigned long)n);
+}
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof(a[0])))
+
+/* Appends a random expression of at most depth levels to s. */
+static void generate(char *s, int depth) {
+    s += strlen(s);
+    if (depth <= 0 || pick(6) == 0) {
+        if (pick(3)) sprintf(s, "%c", "xyz"[pick(3)]);
+        else sprintf(s, "%d.%d", pick(100), pick(10));
+        return;
+    }
+    switch (pick(5)) {
+        case 0: case 1: case 2:
+            strcat(s, "(");
+            generate(s, depth - 1);
+            sprintf(s + strlen(s), "%c", operators[pick(5)]);
+            generate(s, depth - 1);
+            strcat(s, ")");
+            break;
+        case 3:
+            sprintf(s, "%s(", unary[pick(COUNT(unary))]);
+            generate(s, depth - 1);
+            strcat(s, ")");
+            break;
+        default:
+            strcat(s, "pow(");
+            generate(s, depth - 1);
+            strcat(s, ",");
+            generate(s, depth - 1);
+            strcat(s, ")");
+            break;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    te_variable vars[] = {{"x", &x}, {"y", &y}, {"z", &z}};
+    int count = argc > 1 ? atoi(argv[1]) : 10000, d, i, error;
+    char text[TEXT];
+    size_t nodes, tree, packed, total_tree = 0, total_packed = 0;
+
+    if (count < 1) return 1;
+    printf("%d expressions per depth, node bytes\n", count);
+    printf("%6s %12s %12s %12s %8s\n", "depth", "nodes", "tree", "packed", "packed%");
+    for (d = 1; d <= DEPTHS; ++d) {
+        seed = (unsigned long)d;
+        nodes = tree = packed = 0;
+        for (i = 0; i < count; ++i) {
+            te_expr *n;
+            te_packed *p;
+
+            text[0] = '\0';
+            generate(text, d * 2);
+            if (!(n = te_compile(text, vars, 3, &error))) continue;
+            if (!(p = te_pack(n))) return 1;
+            nodes += te_node_count(n, 0);
+            tree += te_node_bytes(n);
+            packed += te_packed_size(p);
+            te_packed_free(p);
+            te_free(n);
+        }
+        printf("%6d %12lu %12lu %12lu %7.1f%%\n", d * 2, (unsigned long)nodes,
+                (unsigned long)tree, (unsigned long)packed, tree ? 100.0 * packed / tree : 0.0);
+        total_tree += tree;
+        total_packed += packed;
+    }
+    printf("%6s %12s %12lu %12lu %7.1f%%\n", "all", "", (unsigned long)total_tree,
+            (unsigned long)total_packed, total_tree ? 100.0 * total_packed / total_tree : 0.0);
+    return 0;
+}
@@ -0,0 +1,85 @@
+/* Times compiling and evaluating everyday formulas through each evaluator,
+ * in nanoseconds per call (best of REPEAT runs), against the same formula written in C. Build with
+ *   cc -O2 -DTE_JIT -DTE_SIMD benchmark.c tinyexpr.c -lm
+ */
+#include "tinyexpr.h"
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+
+#define ROWS 4096
+#define LOOPS 500
+#define REPEAT 5
+
+static double a5(double a) {return a+5;}
+static double a52(double a) {return (a+5)*2;}
+static double a10(double a) {return (a+(a*a+1))/(a*2+1);}
+static double as(double a) {return sqrt(pow(a, 1.5) + pow(a, 2.5));}
+static double al(double a) {return 1/(a+1)+2/(a+2)+3/(a+3);}
+static double ap(double a) {return exp(-a*a/2)*cos(a*3)+atan2(a, 2)*log(a+1);}
+
+static const struct {const char *text; double (*native)(double);} cases[] = {
+    {"a+5", a5},
+    {"(a+5)*2", a52},
+    {"(a+(a*a+1))/(a*2+1)", a10},
+    {"sqrt(a^1.5+a^2.5)", as},
+    {"1/(a+1)+2/(a+2)+3/(a+3)", al},
+    {"exp(-a*a/2)*cos(a*3)+atan2(a,2)*ln(a+1)", ap},
+};
+
+static double a;
+static double column[ROWS], out[ROWS];
+static volatile double sink;
+
+/* Returns the best of REPEAT timings of one evaluator, in ns per call. */
+static double best(int how, size_t c, te_expr *n, te_program *p, te_jit *j) {
+    const double *columns[1];
+    double fastest = 0, calls = (double)LOOPS * ROWS, t, sum;
+    te_variable vars[1];
+    clock_t start;
+    size_t i;
+    int r, l;
+
+    vars[0].name = "a"; vars[0].address = &a; vars[0].type = TE_VARIABLE; vars[0].context = 0;
+    columns[0] = column;
+    for (r = 0; r < REPEAT; ++r) {
+        start = clock();
+        sum = 0;
+        switch (how) {
+            case 0: for (l = 0; l < LOOPS; ++l) te_free(te_compile(cases[c].text, vars, 1, 0)); break;
+            case 1: for (l = 0; l < LOOPS; ++l) for (i = 0; i < ROWS; ++i) sum += cases[c].native(column[i]); break;
+            case 2: for (l = 0; l < LOOPS; ++l) for (i = 0; i < ROWS; ++i) {a = column[i]; sum += te_eval(n);} break;
+            case 3: for (l = 0; l < LOOPS; ++l) for (i = 0; i < ROWS; ++i) {a = column[i]; sum += te_program_eval(p);} break;
+            case 4: for (l = 0; l < LOOPS; ++l) for (i = 0; i < ROWS; ++i) {a = column[i]; sum += te_jit_eval(j);} break;
+            default: for (l = 0; l < LOOPS; ++l) {te_eval_batch(n, columns, ROWS, out); sum += out[ROWS / 2];} break;
+        }
+        sink = sum;
+        t = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / (how ? calls : LOOPS);
+        if (!r || t < fastest) fastest = t;
+    }
+    return fastest;
+}
+
+int main() {
+    te_variable vars[1];
+    size_t c, i;
+    int how;
+
+    vars[0].name = "a"; vars[0].address = &a; vars[0].type = TE_VARIABLE; vars[0].context = 0;
+    for (i = 0; i < ROWS; ++i) column[i] = (double)i / ROWS * 10;
+
+    printf("%-42s %8s %8s %8s %8s %8s %8s\n", "ns per call", "compile", "native", "te_eval", "program", "jit", "batch");
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+        te_expr *n = te_compile(cases[c].text, vars, 1, 0);
+        te_program *p = te_program_compile(n);
+        te_jit *j = te_jit_compile(n);
+
+        printf("%-42s", cases[c].text);
+        for (how = 0; how < 6; ++how) printf(how ? " %8.2f" : " %8.1f", best(how, c, n, p, j));
+        printf("\n");
+        te_jit_free(j);
+        te_program_free(p);
+        te_free(n);
+    }
+    return 0;
+}
@@ -0,0 +1,190 @@
+/* Cross-checks te_eval_batch against te_eval row by row: comma formulas
+ * under every instruction set te_set_batch_isa accepts, and a randomized
+ * corpus of operators, builtins, commas, a pure user function, a closure
+ * and an impure three-argument function over three variables, which
+ * must match bit for bit with the scalar and SSE2 kernels. Build with
+ *   cc -O2 -DTE_SIMD test_batch.c tinyexpr.c -lm
+ * and pass a seed and expression count to change the corpus.
+ */
+#include "tinyexpr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define ROWS 1000
+#define TEXT 4096
+
+static const char *const formulas[] = {
+    "(1,x*2)+(y+1)*3", "(x,y)*(y,x)", "x-(y,2*x)", "(x+y,x*y,x/y)+1",
+    "((x,y),(y,x))*x", "(y,x)", "(1,2)", "sqrt((x,x*x))+(y,y*y)",
+    "(x*y,x+y)*(x-y,x/y)+(y+1,x-1)*(2,y)", "(mix(x,y),user3(x,y,z))*twice(x)"
+};
+
+static const char *const isas[] = {"scalar", "sse2", "avx2", "avx512"};
+
+static const char *const unary[] = {"abs", "acos", "asin", "atan", "ceil", "cos", "cosh", "exp", "fac",
+    "floor", "ln", "log", "log10", "sin", "sinh", "sqrt", "tan", "tanh", "twice"};
+static const char *const binary[] = {"atan2", "ncr", "npr", "pow", "mix"};
+static const char *const operators = "+-*/^%";
+static const char *const constants[] = {"0", "1", "2", "0.5", "3.75", "1e-300", "1e300", "pi", "e", "-0"};
+
+static double twice(double a) {return a + a;}
+static double mix(void *context, double a, double b) {return a * *(double*)context - b;}
+static double user3(double a, double b, double c) {return a * b + c;}
+
+static unsigned long seed;
+
+static int pick(int n) {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return (int)((seed >> 33) % (unsigned long)n);
+}
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof(a[0])))
+
+/* Appends a random expression of at most depth levels to s. */
+static void generate(char *s, int depth) {
+    int paren;
+
+    s += strlen(s);
+    if (depth <= 0 || pick(8) == 0) {
+        if (pick(2)) sprintf(s, "%s", constants[pick(COUNT(constants))]);
+        else sprintf(s, "%c", "xyz"[pick(3)]);
+        return;
+    }
+    switch (pick(7)) {
+        case 0: case 1: case 2:
+            generate(s, depth - 1);
+            sprintf(s + strlen(s), "%c", operators[pick(6)]);
+            generate(s, depth - 1);
+            break;
+        case 3:
+            paren = pick(2);
+            strcat(s, paren ? "-(" : "-");
+            generate(s, depth - 1);
+            if (paren) strcat(s, ")");
+            break;
+        case 4:
+            sprintf(s, "%s(", unary[pick(COUNT(unary))]);
+            generate(s, depth - 1);
+            strcat(s, ")");
+            break;
+        case 5:
+            sprintf(s, "%s(", pick(4) ? binary[pick(COUNT(binary))] : "user3");
+            generate(s, depth - 1);
+            strcat(s, ",");
+            generate(s, depth - 1);
+            if (s[0] == 'u') {
+                strcat(s, ",");
+                generate(s, depth - 1);
+            }
+            strcat(s, ")");
+            break;
+        default:
+            strcat(s, "(");
+            generate(s, depth - 1);
+            strcat(s, pick(2) ? ")" : ",");
+            if (s[strlen(s) - 1] == ',') {
+                generate(s, depth - 1);
+                strcat(s, ")");
+            }
+            break;
+    }
+}
+
+static double x, y, z, context = 1.5;
+static double xs[ROWS], ys[ROWS], zs[ROWS], out[ROWS];
+static te_variable vars[6];
+static int failures;
+
+static int same(double a, double b) {
+    return a == b ? (a != 0 || 1 / a == 1 / b) : (a != a && b != b);
+}
+
+/* Fills the columns with special values, then random ones. */
+static void columns_fill(void) {
+    static const double special[] = {0, -0.0, 1, -1, 0.5, 3, 1e-310, 1e308, -1e308};
+    int i;
+
+    for (i = 0; i < ROWS; ++i) {
+        if (i < COUNT(special) * 3) {
+            xs[i] = special[i % COUNT(special)];
+            ys[i] = special[(i / 3) % COUNT(special)];
+            zs[i] = special[(i * 7) % COUNT(special)];
+        } else {
+            xs[i] = (pick(20001) - 10000) / 1000.0;
+            ys[i] = (pick(20001) - 10000) / 1000.0;
+            zs[i] = (pick(2001) - 1000) / 1000.0;
+        }
+    }
+}
+
+/* Compares te_eval_batch on the columns with te_eval under the */
+/* instruction sets up to last. Results must match exactly with the */
+/* scalar and SSE2 kernels, and to 1e-12 with the vector math ones. */
+static void check(const char *formula, int last) {
+    const double *columns[3];
+    te_expr *n;
+    double want;
+    int isa, i, error;
+
+    n = te_compile(formula, vars, 6, &error);
+    if (!n) {
+        printf("FAILED %s: error at %d\n", formula, error);
+        ++failures;
+        return;
+    }
+    columns[0] = xs;
+    columns[1] = ys;
+    columns[2] = zs;
+    for (isa = TE_ISA_SCALAR; isa <= last; ++isa) {
+        if (te_set_batch_isa(isa) != isa) continue;
+        te_eval_batch(n, columns, ROWS, out);
+        for (i = 0; i < ROWS; ++i) {
+            x = xs[i];
+            y = ys[i];
+            z = zs[i];
+            want = te_eval(n);
+            if (same(out[i], want)) continue;
+            if (isa > TE_ISA_SSE2 && fabs(out[i] - want) <= 1e-12 * fabs(want)) continue;
+            printf("FAILED %s, %s, x=%.17g y=%.17g z=%.17g: te_eval_batch gave %.17g, te_eval %.17g\n",
+                    formula, isas[isa], x, y, z, out[i], want);
+            ++failures;
+            break;
+        }
+    }
+    te_free(n);
+}
+
+int main(int argc, char *argv[]) {
+    char *text = malloc(TEXT * 8);
+    int count = argc > 2 ? atoi(argv[2]) : 2000, best = te_batch_isa(), e;
+
+    seed = argc > 1 ? strtoul(argv[1], 0, 10) : 1;
+    vars[0].name = "x"; vars[0].address = &x; vars[0].type = TE_VARIABLE; vars[0].context = 0;
+    vars[1].name = "y"; vars[1].address = &y; vars[1].type = TE_VARIABLE; vars[1].context = 0;
+    vars[2].name = "z"; vars[2].address = &z; vars[2].type = TE_VARIABLE; vars[2].context = 0;
+    vars[3].name = "twice"; vars[3].address = twice; vars[3].type = TE_FUNCTION1 | TE_FLAG_PURE; vars[3].context = 0;
+    vars[4].name = "mix"; vars[4].address = mix; vars[4].type = TE_CLOSURE2; vars[4].context = &context;
+    vars[5].name = "user3"; vars[5].address = user3; vars[5].type = TE_FUNCTION3; vars[5].context = 0;
+    if (!text) return 1;
+
+    /* Ordinary values, so vector math stays within the tolerance. */
+    for (e = 0; e < ROWS; ++e) {
+        xs[e] = (e - ROWS / 3) * 0.37;
+        ys[e] = 1.5 + e % 17;
+        zs[e] = 0.25 * (e % 5);
+    }
+    for (e = 0; e < COUNT(formulas); ++e) check(formulas[e], TE_ISA_AVX512);
+
+    columns_fill();
+    for (e = 0; e < count; ++e) {
+        text[0] = 0;
+        generate(text, 1 + pick(6));
+        check(text, TE_ISA_SSE2);
+    }
+    te_set_batch_isa(best);
+    printf("%d formulas, %d expressions, %d failures\n", COUNT(formulas), count, failures);
+    free(text);
+    return failures != 0;
+}
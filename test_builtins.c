@@ -0,0 +1,66 @@
+/* Checks fac, ncr and npr on ordinary, out-of-range and NaN arguments,
+ * through te_interp and through te_eval with the arguments in variables,
+ * so they are computed at run time. NaN arguments give NaN. Build with
+ *   cc -O2 test_builtins.c tinyexpr.c -lm
+ */
+#include "tinyexpr.h"
+#include <stdio.h>
+
+/* Expected results that are not numbers. */
+#define NOT_A_NUMBER -1
+#define INFINITE -2
+
+static const struct {const char *name; int arity; double a, b, want;} cases[] = {
+    {"fac", 1, 0, 0, 1}, {"fac", 1, 5, 0, 120}, {"fac", 1, 5.9, 0, 120},
+    {"fac", 1, -1, 0, NOT_A_NUMBER}, {"fac", 1, 1e300, 0, INFINITE},
+    {"ncr", 2, 5, 2, 10}, {"ncr", 2, 5, 5, 1}, {"ncr", 2, 2, 5, NOT_A_NUMBER},
+    {"ncr", 2, -1, 0, NOT_A_NUMBER}, {"ncr", 2, 1e300, 1, INFINITE},
+    {"npr", 2, 5, 2, 20}, {"npr", 2, 5, 0, 1}, {"npr", 2, 1, 2, NOT_A_NUMBER},
+};
+
+static double a, b;
+static int failures;
+
+static void check(const char *what, const char *text, double got, double want) {
+    if (want == NOT_A_NUMBER ? got != got : want == INFINITE ? got > 1e308 : got == want) return;
+    printf("FAILED %s %s: gave %.17g\n", what, text, got);
+    ++failures;
+}
+
+int main(void) {
+    te_variable vars[] = {{"a", &a}, {"b", &b}};
+    const char *const nan_calls[] = {"fac(a)", "ncr(a,b)", "ncr(b,a)", "npr(a,b)", "npr(b,a)"};
+    char text[64];
+    te_expr *n;
+    size_t i;
+    int error;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        sprintf(text, "%s(%.17g,%.17g)", cases[i].name, cases[i].a, cases[i].b);
+        if (cases[i].arity == 1) sprintf(text, "%s(%.17g)", cases[i].name, cases[i].a);
+        check("te_interp", text, te_interp(text, &error), cases[i].want);
+
+        a = cases[i].a;
+        b = cases[i].b;
+        sprintf(text, "%s(%s)", cases[i].name, cases[i].arity == 1 ? "a" : "a,b");
+        if (!(n = te_compile(text, vars, 2, &error))) return 1;
+        check("te_eval", text, te_eval(n), cases[i].want);
+        te_free(n);
+    }
+
+    /* NaN used to give 1 or inf, or, where the compiler converted it to */
+    /* unsigned 0, loop in ncr for 2^64 iterations. */
+    a = 0.0;
+    a = a / a;
+    b = 2;
+    for (i = 0; i < sizeof(nan_calls) / sizeof(nan_calls[0]); ++i) {
+        if (!(n = te_compile(nan_calls[i], vars, 2, &error))) return 1;
+        check("te_eval with a = NaN", nan_calls[i], te_eval(n), NOT_A_NUMBER);
+        te_free(n);
+    }
+    check("te_interp", "ncr(0/0,2)", te_interp("ncr(0/0,2)", &error), NOT_A_NUMBER);
+    check("te_interp", "fac(0/0)", te_interp("fac(0/0)", &error), NOT_A_NUMBER);
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures != 0;
+}
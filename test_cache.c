@@ -0,0 +1,51 @@
+/* Checks that te_cache_interp agrees with te_interp, value and error,
+ * on texts that differ only in whitespace, whichever was cached first.
+ * Build with
+ *   cc -O2 test_cache.c tinyexpr.c -lm
+ */
+#include "tinyexpr.h"
+#include <stdio.h>
+
+/* Each group is spellings of one text, ended by NULL. */
+static const char *const groups[][5] = {
+    {"1e+5", "1e +5", "1e+ 5", " 1e+5 ", NULL},
+    {"2e-1", "2e -1", "2e- 1", "2 e-1", NULL},
+    {"1E+5", "1E +5", "1E+ 5", NULL},
+    {"0x1p+3", "0x1p +3", "0x1p+ 3", NULL},
+    {"e+1", "e +1", "e+ 1", " e + 1 ", NULL},
+    {"1e5+1", "1e5 +1", "1e5+ 1", NULL},
+    {"pi*2", "pi * 2", "p i*2", NULL},
+    {"1.5", "1 .5", "1. 5", NULL},
+    {"sin(1)+cos(2)", "sin (1) + cos (2)", "sin(1)+cos( 2 )", NULL}
+};
+
+static int failures;
+
+static void check(te_cache *cache, const char *text) {
+    double want, got;
+    int want_error, got_error;
+
+    want = te_interp(text, &want_error);
+    got = te_cache_interp(cache, text, &got_error);
+    if ((got == want || (got != got && want != want)) && got_error == want_error) return;
+    printf("FAILED \"%s\": te_cache_interp gave %.17g error %d, te_interp %.17g error %d\n",
+            text, got, got_error, want, want_error);
+    ++failures;
+}
+
+int main(void) {
+    te_cache *cache;
+    size_t g;
+    int i, first;
+
+    for (g = 0; g < sizeof(groups) / sizeof(groups[0]); ++g) {
+        for (first = 0; groups[g][first]; ++first) {
+            if (!(cache = te_cache_create(16))) return 1;
+            check(cache, groups[g][first]);
+            for (i = 0; groups[g][i]; ++i) check(cache, groups[g][i]);
+            te_cache_free(cache);
+        }
+    }
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures != 0;
+}
@@ -0,0 +1,162 @@
+/* Compiles, evaluates and frees expressions a million levels deep through
+ * every evaluator, on a thread with a 256 KB stack. Build with
+ *   cc -O2 -DTE_JIT -DTE_SIMD -DTE_THREADS test_deep.c tinyexpr.c -lm -pthread
+ */
+#include "tinyexpr.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define DEPTH 1000000
+#define ROWS 4
+
+static double halve(void *context, double a) {
+    return a * *(double*)context + 1;
+}
+
+static int failures;
+
+/* NAN is C99. */
+static double not_a_number(void) {
+    double zero = 0.0;
+    return zero / zero;
+}
+
+static void check(const char *shape, const char *what, double got, double want, int exact) {
+    if (got == want || (got != got && want != want)) return;
+    if (!exact && fabs(got - want) <= 1e-12 * fabs(want)) return;
+    printf("FAILED %s: %s gave %.17g, te_eval %.17g\n", shape, what, got, want);
+    ++failures;
+}
+
+/* Writes DEPTH copies of open, then x, then DEPTH copies of close. */
+static char *nest(const char *open, const char *close) {
+    size_t a = strlen(open), b = strlen(close), i;
+    char *s = malloc((a + b) * DEPTH + 2), *p = s;
+
+    if (!s) return 0;
+    for (i = 0; i < DEPTH; ++i, p += a) memcpy(p, open, a);
+    *p++ = 'x';
+    for (i = 0; i < DEPTH; ++i, p += b) memcpy(p, close, b);
+    *p = 0;
+    return s;
+}
+
+static void run(const char *shape, char *text) {
+    static double column[ROWS], out[ROWS];
+    double x = 0.75, context = 0.5, want, frame[2];
+    const double *columns[2];
+    te_variable vars[2];
+    te_env *env;
+    te_expr *n, *copy;
+    te_program *program;
+    te_packed *packed;
+    te_jit *jit;
+    te_pool *pool;
+    te_intern *table;
+    size_t size, unique;
+    void *image;
+    int error, isa, i;
+
+    vars[0].name = "x"; vars[0].address = &x; vars[0].type = TE_VARIABLE; vars[0].context = 0;
+    vars[1].name = "h"; vars[1].address = halve; vars[1].type = TE_CLOSURE1; vars[1].context = &context;
+    env = te_env_create(vars, 2);
+    if (!text || !env) {
+        printf("FAILED %s: out of memory\n", shape);
+        ++failures;
+        return;
+    }
+
+    n = te_compile(text, vars, 2, &error);
+    if (!n) {
+        printf("FAILED %s: error at %d\n", shape, error);
+        ++failures;
+        free(text);
+        te_env_free(env);
+        return;
+    }
+    want = te_eval(n);
+    printf("%-22s %10lu nodes  %.17g\n", shape, (unsigned long)te_node_count(n, &unique), want);
+
+    frame[0] = x;
+    frame[1] = 0;
+    check(shape, "te_eval_frame", te_eval_frame(n, frame), want, 1);
+
+    for (i = 0; i < ROWS; ++i) column[i] = x;
+    columns[0] = column;
+    columns[1] = 0;
+    for (isa = TE_ISA_SCALAR; isa <= TE_ISA_AVX512; ++isa) {
+        if (te_set_batch_isa(isa) != isa) continue;
+        te_eval_batch(n, columns, ROWS, out);
+        for (i = 0; i < ROWS; ++i) check(shape, "te_eval_batch", out[i], want, isa == TE_ISA_SCALAR);
+    }
+    te_set_batch_isa(TE_ISA_SCALAR);
+    pool = te_pool_create(2, 0);
+    te_eval_batch_parallel(pool, n, columns, ROWS, out, TE_REDUCE_NONE);
+    for (i = 0; i < ROWS; ++i) check(shape, "te_eval_batch_parallel", out[i], want, 1);
+    te_pool_free(pool);
+
+    program = te_program_compile(n);
+    check(shape, "te_program_eval", program ? te_program_eval(program) : not_a_number(), want, 1);
+    te_program_free(program);
+
+    packed = te_pack(n);
+    check(shape, "te_packed_eval", packed ? te_packed_eval(packed) : not_a_number(), want, 1);
+    te_packed_free(packed);
+
+    jit = te_jit_compile(n);
+    check(shape, "te_jit_eval", jit ? te_jit_eval(jit) : not_a_number(), want, 1);
+    te_jit_free(jit);
+
+    size = te_serialize(n, env, 0, 0);
+    image = size ? malloc(size) : 0;
+    copy = image && te_serialize(n, env, image, size) == size ? te_deserialize(image, size, env, &error) : 0;
+    check(shape, "te_deserialize", copy ? te_eval(copy) : not_a_number(), want, 1);
+    te_free(copy);
+    free(image);
+
+    table = te_intern_create();
+    copy = te_intern_expr(table, te_compile(text, vars, 2, &error));
+    check(shape, "te_intern_expr", copy ? te_eval(copy) : not_a_number(), want, 1);
+    te_free(copy);
+    te_intern_free(table);
+
+    copy = te_optimize(te_compile(text, vars, 2, &error), TE_OPT_SIMPLIFY | TE_OPT_STRENGTH | TE_OPT_STRICT | TE_OPT_CHAIN | TE_OPT_SINCOS, 0);
+    check(shape, "te_optimize", copy ? te_eval(copy) : not_a_number(), want, 1);
+    copy = te_compact(copy);
+    check(shape, "te_compact", copy ? te_eval(copy) : not_a_number(), want, 1);
+    te_free(copy);
+
+    te_free(n);
+    te_env_free(env);
+    free(text);
+}
+
+static void *shapes(void *unused) {
+    (void)unused;
+    run("left chain", nest("x+", ""));
+    run("right chain", nest("(x+", ")"));
+    run("nested parentheses", nest("(", ")"));
+    run("negations", nest("-(", ")"));
+    run("sin(sin(...))", nest("sin(", ")"));
+    run("pow chain", nest("x^", ""));
+    run("closures", nest("h(", ")"));
+    run("mixed", nest("sqrt(x*x+", ")"));
+    return 0;
+}
+
+int main(void) {
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    setvbuf(stdout, 0, _IONBF, 0);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    if (pthread_create(&thread, &attr, shapes, 0) != 0) return 1;
+    pthread_join(thread, 0);
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures != 0;
+}
@@ -0,0 +1,42 @@
+/* Checks the error positions te_compile and te_interp report for malformed
+ * calls, where the parser has to free the arguments it parsed so far and
+ * no others. Build with
+ *   cc -O2 test_errors.c tinyexpr.c -lm
+ * or with -fsanitize=address to check the frees.
+ */
+#include "tinyexpr.h"
+#include <stdio.h>
+
+/* error -1 is an error inside the arguments of a call of two or more. */
+static const struct {const char *text; int error;} cases[] = {
+    {"atan2(1)", -1}, {"atan2(1,2,3)", -1}, {"atan2(1", -1}, {"atan2(", -1},
+    {"atan2()", -1}, {"atan2(,1)", -1}, {"atan2(1,)", -1}, {"atan2(1;2)", -1},
+    {"atan2(sin(1)", -1}, {"pow(1)+2", -1}, {"1+atan2(1)", -1},
+    {"atan2(1,2)+atan2(1)", -1}, {"atan2(1,2)*atan2(3)", -1},
+    {"ncr(5,2)x", 9}, {"pi(1)", 4}, {"e(1)", 3},
+    {"atan2(1,2)", 0}, {"sin(1,2)", 0}, {"pi()", 0}
+};
+
+int main(void) {
+    int failures = 0, error;
+    size_t i;
+    te_expr *n;
+    double r;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        n = te_compile(cases[i].text, 0, 0, &error);
+        if (error != cases[i].error || !n != (cases[i].error != 0)) {
+            printf("FAILED te_compile %s: error %d\n", cases[i].text, error);
+            ++failures;
+        }
+        te_free(n);
+
+        r = te_interp(cases[i].text, &error);
+        if (error != cases[i].error || (r != r) != (cases[i].error != 0)) {
+            printf("FAILED te_interp %s: %g, error %d\n", cases[i].text, r, error);
+            ++failures;
+        }
+    }
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures != 0;
+}
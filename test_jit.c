@@ -0,0 +1,159 @@
+/* Cross-checks te_jit_eval against te_eval on a randomized expression
+ * corpus: operators, builtins, user functions and closures over three
+ * variables, before and after te_optimize. Build with
+ *   cc -O2 -DTE_JIT test_jit.c tinyexpr.c -lm
+ * and pass a seed and expression count to change the corpus.
+ */
+#include "tinyexpr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define TEXT 4096
+#define POINTS 64
+
+static const char *const unary[] = {"abs", "acos", "asin", "atan", "ceil", "cos", "cosh", "exp", "fac",
+    "floor", "ln", "log", "log10", "sin", "sinh", "sqrt", "tan", "tanh", "twice"};
+static const char *const binary[] = {"atan2", "ncr", "npr", "pow", "mix"};
+static const char *const operators = "+-*/^%";
+static const char *const constants[] = {"0", "1", "2", "0.5", "3.75", "1e-300", "1e300", "pi", "e", "-0"};
+static const int flags[] = {0, TE_OPT_SIMPLIFY, TE_OPT_FINITE | TE_OPT_STRENGTH,
+    TE_OPT_STRENGTH | TE_OPT_FMA | TE_OPT_HORNER, TE_OPT_CHAIN | TE_OPT_SINCOS,
+    TE_OPT_CHAIN | TE_OPT_STRICT | TE_OPT_SINCOS, TE_OPT_CSE, TE_OPT_SIMPLIFY | TE_OPT_CSE | TE_OPT_SINCOS};
+
+static double twice(double a) {return a + a;}
+static double mix(void *context, double a, double b) {return a * *(double*)context - b;}
+static double user3(double a, double b, double c) {return a * b + c;}
+
+static unsigned long seed;
+
+static int pick(int n) {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return (int)((seed >> 33) % (unsigned long)n);
+}
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof(a[0])))
+
+/* Appends a random expression of at most depth levels to s. */
+static void generate(char *s, int depth) {
+    int paren;
+
+    s += strlen(s);
+    if (depth <= 0 || pick(8) == 0) {
+        if (pick(2)) sprintf(s, "%s", constants[pick(COUNT(constants))]);
+        else sprintf(s, "%c", "xyz"[pick(3)]);
+        return;
+    }
+    switch (pick(7)) {
+        case 0: case 1: case 2:
+            generate(s, depth - 1);
+            sprintf(s + strlen(s), "%c", operators[pick(6)]);
+            generate(s, depth - 1);
+            break;
+        case 3:
+            paren = pick(2);
+            strcat(s, paren ? "-(" : "-");
+            generate(s, depth - 1);
+            if (paren) strcat(s, ")");
+            break;
+        case 4:
+            sprintf(s, "%s(", unary[pick(COUNT(unary))]);
+            generate(s, depth - 1);
+            strcat(s, ")");
+            break;
+        case 5:
+            sprintf(s, "%s(", pick(4) ? binary[pick(COUNT(binary))] : "user3");
+            generate(s, depth - 1);
+            strcat(s, ",");
+            generate(s, depth - 1);
+            if (s[0] == 'u') {
+                strcat(s, ",");
+                generate(s, depth - 1);
+            }
+            strcat(s, ")");
+            break;
+        default:
+            strcat(s, "(");
+            generate(s, depth - 1);
+            strcat(s, pick(4) ? ")" : ",");
+            if (s[strlen(s) - 1] == ',') {
+                generate(s, depth - 1);
+                strcat(s, ")");
+            }
+            break;
+    }
+}
+
+static double x, y, z, context = 1.5;
+
+static void point(int i) {
+    static const double special[] = {0, -0.0, 1, -1, 0.5, 3, 1e-310, 1e308, -1e308};
+    if (i < COUNT(special) * 3) {
+        x = special[i % COUNT(special)];
+        y = special[(i / 3) % COUNT(special)];
+        z = special[(i * 7) % COUNT(special)];
+    } else {
+        x = (pick(20001) - 10000) / 1000.0;
+        y = (pick(20001) - 10000) / 1000.0;
+        z = (pick(2001) - 1000) / 1000.0;
+    }
+}
+
+static int same(double a, double b) {
+    return a == b ? (a != 0 || 1 / a == 1 / b) : (a != a && b != b);
+}
+
+int main(int argc, char *argv[]) {
+    te_variable vars[6];
+    char *text = malloc(TEXT * 8);
+    int count = argc > 2 ? atoi(argv[2]) : 20000, checked = 0, failures = 0, e, f, i, error;
+
+    seed = argc > 1 ? strtoul(argv[1], 0, 10) : 1;
+    vars[0].name = "x"; vars[0].address = &x; vars[0].type = TE_VARIABLE; vars[0].context = 0;
+    vars[1].name = "y"; vars[1].address = &y; vars[1].type = TE_VARIABLE; vars[1].context = 0;
+    vars[2].name = "z"; vars[2].address = &z; vars[2].type = TE_VARIABLE; vars[2].context = 0;
+    vars[3].name = "twice"; vars[3].address = twice; vars[3].type = TE_FUNCTION1 | TE_FLAG_PURE; vars[3].context = 0;
+    vars[4].name = "mix"; vars[4].address = mix; vars[4].type = TE_CLOSURE2; vars[4].context = &context;
+    vars[5].name = "user3"; vars[5].address = user3; vars[5].type = TE_FUNCTION3; vars[5].context = 0;
+    if (!text) return 1;
+
+    for (e = 0; e < count; ++e) {
+        text[0] = 0;
+        generate(text, 1 + pick(6));
+        for (f = 0; f < COUNT(flags); ++f) {
+            te_expr *n = te_compile(text, vars, 6, &error);
+            te_jit *j;
+
+            if (!n) {
+                printf("FAILED to compile %s at %d\n", text, error);
+                ++failures;
+                break;
+            }
+            if (flags[f]) n = te_optimize(n, flags[f], 0);
+            j = te_jit_compile(n);
+            for (i = 0; j && i < POINTS; ++i) {
+                double want, got;
+                point(i);
+                want = te_eval(n);
+                got = te_jit_eval(j);
+                ++checked;
+                if (!same(got, want)) {
+                    printf("FAILED %s (flags %d) at x=%.17g y=%.17g z=%.17g: jit %.17g, te_eval %.17g\n",
+                            text, flags[f], x, y, z, got, want);
+                    ++failures;
+                    break;
+                }
+            }
+            if (!j) {
+                printf("FAILED to jit %s\n", text);
+                ++failures;
+            }
+            te_jit_free(j);
+            te_free(n);
+        }
+    }
+    printf("%d expressions, %d evaluations, %d failures\n", count, checked, failures);
+    free(text);
+    return failures != 0;
+}
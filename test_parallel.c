@@ -0,0 +1,99 @@
+/* Checks that te_eval_batch_parallel gives the same rows as te_eval_batch
+ * and the same reductions bit for bit with no pool and with pools of 1, 2
+ * and more threads, and that pools shut down cleanly, idle or not. Build
+ * with
+ *   cc -O2 -DTE_THREADS test_parallel.c tinyexpr.c -lm -pthread
+ */
+#include "tinyexpr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROWS 100003
+
+static const char *const formulas[] = {
+    "x*y+1", "sqrt(x*x+y*y)", "exp(-x/1000)*sin(y)", "1/(x-50000)", "x-x+y*1e300*1e10"
+};
+
+static const int threads[] = {1, 2, 3, 8};
+
+static const char *const reductions[] = {"none", "sum", "min", "max"};
+
+static double x, y;
+static double xs[ROWS], ys[ROWS], want[ROWS], got[ROWS];
+static int failures;
+
+/* Same bits, so NaNs match and 0 differs from -0. */
+static int same(double a, double b) {
+    return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+static void check(const char *formula, te_expr *n, te_pool *pool, const char *name, const double *first) {
+    const double *columns[2];
+    double r;
+    int reduce, i;
+
+    columns[0] = xs;
+    columns[1] = ys;
+    memset(got, 0, sizeof(got));
+    te_eval_batch_parallel(pool, n, columns, ROWS, got, TE_REDUCE_NONE);
+    for (i = 0; i < ROWS; ++i) {
+        if (same(got[i], want[i])) continue;
+        printf("FAILED %s, %s, row %d: %.17g, te_eval_batch %.17g\n", formula, name, i, got[i], want[i]);
+        ++failures;
+        break;
+    }
+    for (reduce = TE_REDUCE_SUM; reduce <= TE_REDUCE_MAX; ++reduce) {
+        r = te_eval_batch_parallel(pool, n, columns, ROWS, 0, reduce);
+        if (same(r, first[reduce])) continue;
+        printf("FAILED %s, %s, %s: %.17g, without a pool %.17g\n", formula, name, reductions[reduce],
+                r, first[reduce]);
+        ++failures;
+    }
+}
+
+int main(void) {
+    te_variable vars[] = {{"x", &x}, {"y", &y}};
+    const double *columns[2];
+    double first[4];
+    te_pool *pools[sizeof(threads) / sizeof(threads[0])];
+    char name[32];
+    size_t f, p;
+    int reduce, i, error;
+
+    for (i = 0; i < ROWS; ++i) {
+        xs[i] = i;
+        ys[i] = (i % 1000) * 1e-3 - 0.5;
+    }
+    columns[0] = xs;
+    columns[1] = ys;
+
+    for (p = 0; p < sizeof(threads) / sizeof(threads[0]); ++p) {
+        if (!(pools[p] = te_pool_create(threads[p], 0))) return 1;
+    }
+
+    for (f = 0; f < sizeof(formulas) / sizeof(formulas[0]); ++f) {
+        te_expr *n = te_compile(formulas[f], vars, 2, &error);
+
+        if (!n) return 1;
+        te_eval_batch(n, columns, ROWS, want);
+        for (reduce = TE_REDUCE_SUM; reduce <= TE_REDUCE_MAX; ++reduce) {
+            first[reduce] = te_eval_batch_parallel(0, n, columns, ROWS, 0, reduce);
+        }
+        check(formulas[f], n, 0, "no pool", first);
+        for (p = 0; p < sizeof(threads) / sizeof(threads[0]); ++p) {
+            sprintf(name, "%d threads", te_pool_threads(pools[p]));
+            check(formulas[f], n, pools[p], name, first);
+        }
+        te_free(n);
+    }
+
+    for (p = 0; p < sizeof(threads) / sizeof(threads[0]); ++p) te_pool_free(pools[p]);
+
+    /* Pools freed straight away, before their workers have started. */
+    for (i = 0; i < 100; ++i) te_pool_free(te_pool_create(1 + i % 4, 0));
+    te_pool_free(0);
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures != 0;
+}
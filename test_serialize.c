@@ -0,0 +1,166 @@
+/* Round-trips expressions through te_serialize and te_deserialize, plain
+ * and after TE_OPT_CSE, and through an image file, checking that the
+ * copies evaluate like the originals and that every truncated image is
+ * rejected. Images naming one leaf record from two parents, which
+ * te_serialize never writes but a corrupt file may, make the second
+ * parent copy the leaf; build with
+ *   cc -O1 -g -fsanitize=address test_serialize.c tinyexpr.c -lm
+ * to catch over-reads.
+ */
+#include "tinyexpr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const formulas[] = {
+    "x", "2", "x*x", "x*x*x+x", "1.5*x+1.5*y+1.5", "sin(x)*sin(x)+cos(x)*cos(x)",
+    "(x+y)*(x+y)-(x+y)", "mix(x,x)+mix(y,x)", "twice(x)+twice(x)*y", "pow(x,y)+pow(x,y)/x",
+    "(x,y,x)+(y,x,y)", "atan2(x*y+1,x*y+1)"
+};
+
+static double twice(double a) {return a + a;}
+static double mix(void *context, double a, double b) {return a * *(double*)context - b;}
+
+static double x, y, context = 1.5;
+static int failures;
+
+static int same(double a, double b) {
+    return memcmp(&a, &b, sizeof(double)) == 0 || (a != a && b != b);
+}
+
+/* Compares te_eval of copy and n at a few points, then frees copy. */
+static void compare(const char *what, const char *formula, const te_expr *n, te_expr *copy) {
+    static const double points[] = {0, -0.0, 1, -2.5, 3.75, 1e300};
+    int i, j;
+
+    if (!copy) {
+        printf("FAILED %s %s: no copy\n", what, formula);
+        ++failures;
+        return;
+    }
+    for (i = 0; i < 6; ++i) {
+        for (j = 0; j < 6; ++j) {
+            double want, got;
+            x = points[i];
+            y = points[j];
+            want = te_eval(n);
+            got = te_eval(copy);
+            if (same(got, want)) continue;
+            printf("FAILED %s %s at x=%g y=%g: %.17g, original %.17g\n", what, formula, x, y, got, want);
+            ++failures;
+            i = j = 6;
+        }
+    }
+    te_free(copy);
+}
+
+/* Writes the image of formula to data, returning its size or 0. */
+static size_t image(const char *formula, const te_env *env, unsigned char *data, size_t size) {
+    te_expr *n;
+    int error;
+
+    n = te_compile_env(formula, env, &error);
+    size = n ? te_serialize(n, env, data, size) : 0;
+    te_free(n);
+    return size;
+}
+
+
+/* Builds the image of leaf*leaf with one record for the leaf, named by */
+/* both children of the product, and checks it evaluates to want. */
+static void shared_leaf(const char *leaf, const te_env *env, double want) {
+    unsigned char a[64], x[64], b[128], data[192];
+    size_t sa, sx, sb, record, product;
+    te_expr *n;
+    int error;
+
+    /* An image is a header and a record count, then the records. The */
+    /* product of x*x comes after two records of x and ends with its */
+    /* children, 0 and 1. */
+    sa = image(leaf, env, a, sizeof(a));
+    sx = image("x", env, x, sizeof(x));
+    sb = image("x*x", env, b, sizeof(b));
+    if (sa < 9 || sa > sizeof(a) || sx < 9 || sx > sizeof(x) || sb < 2 * sx || sb > sizeof(b)) return;
+    record = sa - 8;
+    product = sb - 8 - 2 * (sx - 8);
+    memcpy(data, a, 4);
+    memcpy(data + 4, "\2\0\0\0", 4);
+    memcpy(data + 8, a + 8, record);
+    memcpy(data + 8 + record, b + sb - product, product);
+    memset(data + 8 + record + product - 4, 0, 4);
+
+    n = te_deserialize(data, 8 + record + product, env, &error);
+    if (!n || te_eval(n) != want) {
+        printf("FAILED %s*%s with a shared leaf: %s\n", leaf, leaf, n ? "wrong value" : "rejected");
+        ++failures;
+    }
+    te_free(n);
+}
+
+
+int main(void) {
+    te_variable vars[4];
+    te_env *env;
+    te_image *image;
+    const char *path = "test_serialize.img";
+    unsigned char *data;
+    size_t f, size, cut;
+    int cse, error;
+
+    vars[0].name = "x"; vars[0].address = &x; vars[0].type = TE_VARIABLE; vars[0].context = 0;
+    vars[1].name = "y"; vars[1].address = &y; vars[1].type = TE_VARIABLE; vars[1].context = 0;
+    vars[2].name = "twice"; vars[2].address = twice; vars[2].type = TE_FUNCTION1 | TE_FLAG_PURE; vars[2].context = 0;
+    vars[3].name = "mix"; vars[3].address = mix; vars[3].type = TE_CLOSURE2 | TE_FLAG_PURE; vars[3].context = &context;
+    if (!(env = te_env_create(vars, 4))) return 1;
+
+    for (f = 0; f < sizeof(formulas) / sizeof(formulas[0]); ++f) {
+        for (cse = 0; cse < 2; ++cse) {
+            te_expr *n = te_compile_env(formulas[f], env, &error);
+
+            if (!n) return 1;
+            if (cse) n = te_optimize(n, TE_OPT_CSE, 0);
+            size = te_serialize(n, env, 0, 0);
+            if (!size || !(data = malloc(size))) return 1;
+            te_serialize(n, env, data, size);
+            compare(cse ? "te_deserialize after TE_OPT_CSE" : "te_deserialize", formulas[f], n,
+                    te_deserialize(data, size, env, &error));
+
+            /* Every prefix of the image is incomplete. */
+            for (cut = 0; cut < size; ++cut) {
+                te_expr *bad = te_deserialize(data, cut, env, &error);
+                if (!bad && error) continue;
+                printf("FAILED %s cut to %lu bytes: %s\n", formulas[f], (unsigned long)cut,
+                        bad ? "accepted" : "no error");
+                ++failures;
+                te_free(bad);
+                break;
+            }
+            free(data);
+            te_free(n);
+        }
+    }
+
+    x = 3;
+    shared_leaf("x", env, 9);
+    shared_leaf("2", env, 4);
+
+    if (te_image_save(path, formulas, (int)(sizeof(formulas) / sizeof(formulas[0])), env) < 0
+            || !(image = te_image_open(path))) {
+        printf("FAILED to write and open %s\n", path);
+        remove(path);
+        return 1;
+    }
+    for (f = 0; f < sizeof(formulas) / sizeof(formulas[0]); ++f) {
+        te_expr *n = te_compile_env(formulas[f], env, &error);
+
+        if (!n) return 1;
+        compare("te_image_load", formulas[f], n, te_image_load(image, formulas[f], env, &error));
+        te_free(n);
+    }
+    te_image_close(image);
+    remove(path);
+    te_env_free(env);
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures != 0;
+}
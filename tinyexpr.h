@@ -26,6 +26,7 @@
 #ifndef TINYEXPR_H
 #define TINYEXPR_H
 
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,6 +34,12 @@ extern "C" {
 
 
 
+/* type holds the node kind in bits 0-4 (TE_VARIABLE, TE_FUNCTIONn or */
+/* TE_CLOSUREn, or 1 for a constant) and TE_FLAG_PURE in bit 5. The */
+/* bits above are internal: a variable's slot, the number of extra */
+/* parents sharing a function node after TE_OPT_CSE or te_intern_expr, */
+/* and te_compact's block flag. */
+/* Mask type with 0x1F | TE_FLAG_PURE before comparing it. */
 typedef struct te_expr {
     int type;
     union {double value; const double *bound; const void *function;};
@@ -61,7 +68,7 @@ typedef struct te_variable {
 
 
 
-/* Parses the input expression, evaluates it, and frees it. */
+/* Parses the input expression, evaluating as it goes without allocating. */
 /* Returns NaN on error. */
 double te_interp(const char *expression, int *error);
 
@@ -69,9 +76,248 @@ double te_interp(const char *expression, int *error);
 /* Returns NULL on error. */
 te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error);
 
+/* Same as te_compile for the len bytes at expression, which need not be */
+/* NUL-terminated. Nothing past expression + len is read. */
+te_expr *te_compile_n(const char *expression, size_t len, const te_variable *variables, int var_count, int *error);
+
+/* Node allocator for te_compile_ex. free may be NULL, e.g. for arenas. */
+typedef struct te_allocator {
+    void *(*alloc)(void *context, size_t size);
+    void (*free)(void *context, void *ptr);
+    void *context;
+} te_allocator;
+
+/* Same as te_compile, with nodes taken from allocator (malloc if NULL). */
+/* error is -1 when an allocation fails, e.g. a fixed arena is full. */
+te_expr *te_compile_ex(const char *expression, const te_variable *variables, int var_count,
+        const te_allocator *allocator, int *error);
+
+typedef struct te_env te_env;
+
+/* Builds a hash table over the variable names, for fast lookups in */
+/* te_compile_env. variables must outlive it. The env is never modified */
+/* afterwards, so many threads may compile against it at once. */
+/* Returns NULL on error. */
+te_env *te_env_create(const te_variable *variables, int var_count);
+
+/* Same as te_compile with the variables given to te_env_create. */
+te_expr *te_compile_env(const char *expression, const te_env *env, int *error);
+
+/* Formula layouts for te_compile_bulk: one per line, or each prefixed */
+/* with its length as a 32-bit little-endian integer. */
+enum {TE_BULK_LINES, TE_BULK_LENGTH};
+
+/* Compiles every formula in the size bytes at data, e.g. a mapped file, */
+/* in place. The first capacity results go to out[i] and, when errors is */
+/* not NULL, their te_compile error to errors[i]; a truncated length */
+/* prefix fails with error 1 and ends the scan. */
+/* Returns the number of formulas, so capacity 0 counts them. */
+size_t te_compile_bulk(const char *data, size_t size, int format, const te_env *env,
+        te_expr **out, int *errors, size_t capacity);
+
+/* Frees the environment. */
+/* This is safe to call on NULL pointers. */
+void te_env_free(te_env *env);
+
+/* Rewrites for te_optimize. TE_OPT_SIMPLIFY drops identities such as */
+/* x*1, x-0, x^1 and --x and folds negations into subtractions, keeping */
+/* every result, the sign of zero included. TE_OPT_FINITE adds rewrites */
+/* that assume finite values and ignore the sign of zero, such as x+0, */
+/* x*0 and x-x, and implies TE_OPT_SIMPLIFY. TE_OPT_STRENGTH turns */
+/* powers with constant exponents up to 8 in magnitude into multiplies, */
+/* reciprocals and square roots, and divisions by powers of two into */
+/* multiplications; the results may differ from pow in the last bits, */
+/* and on -0 and -Inf for square roots. With TE_OPT_STRICT it only */
+/* makes the rewrites that keep every result bit. TE_OPT_FMA contracts */
+/* a*b+c, a*b-c and c-a*b into fused multiply-adds, rounded once. */
+/* TE_OPT_HORNER rebuilds polynomials of one variable with constant */
+/* coefficients, up to degree 12, in Horner form. This changes their */
+/* rounding: near a root the result may differ in every digit and in */
+/* sign, and where a term overflows or the variable is infinite it may */
+/* differ in kind, as x^3-3*x^2+3*x-1 giving Inf instead of NaN at Inf. */
+/* Terms that cancel, as in x^2-x^2+x, are only dropped with */
+/* TE_OPT_FINITE. TE_OPT_CHAIN rebuilds long chains of + and of * as */
+/* balanced trees, which reorders their rounding; with TE_OPT_STRICT it */
+/* keeps their order instead, evaluating seven terms per call. */
+/* TE_OPT_SINCOS computes sin and cos of the same pure argument with */
+/* one call, and sinh, cosh and tanh from one exp; the hyperbolic ones */
+/* may differ from libm in the last bits, and are left alone with */
+/* TE_OPT_STRICT. TE_OPT_CSE merges equal pure subtrees into one node */
+/* with several parents, which te_program_compile computes once per */
+/* evaluation; te_eval, te_eval_batch and the JIT compute it per use, */
+/* with the same results. */
+enum {TE_OPT_SIMPLIFY = 1, TE_OPT_FINITE = 2, TE_OPT_STRENGTH = 4, TE_OPT_STRICT = 8, TE_OPT_FMA = 16,
+    TE_OPT_HORNER = 32, TE_OPT_CHAIN = 64, TE_OPT_SINCOS = 128, TE_OPT_CSE = 256};
+
+/* Rules counted by te_optimize. TE_RULE_POLY counts the polynomials */
+/* rebuilt and TE_RULE_DEGREE sums their degrees. TE_RULE_SINCOS counts */
+/* the calls that share their work with another, and TE_RULE_CSE the */
+/* nodes merged away. */
+enum {
+    TE_RULE_FOLD, TE_RULE_IDENTITY, TE_RULE_NEGATE, TE_RULE_SUBTRACT,
+    TE_RULE_ZERO, TE_RULE_SELF, TE_RULE_POWER, TE_RULE_ROOT,
+    TE_RULE_RECIPROCAL, TE_RULE_FMA, TE_RULE_POLY, TE_RULE_DEGREE,
+    TE_RULE_CHAIN, TE_RULE_SINCOS, TE_RULE_CSE,
+    TE_RULE_COUNT
+};
+
+/* Rewrites n, compiled with malloc and not interned, with the rewrites */
+/* in flags, and frees what it no longer uses. When counts is not NULL, */
+/* counts[rule] is increased by the times each rule applied; it has */
+/* TE_RULE_COUNT entries. Returns n or the expression it became, partly */
+/* rewritten if out of memory. */
+te_expr *te_optimize(te_expr *n, int flags, size_t *counts);
+
 /* Evaluates the expression. */
 double te_eval(const te_expr *n);
 
+/* Evaluates the expression with variables[i] given to te_compile reading */
+/* frame[i]. Their addresses are never read and may be NULL, so one */
+/* expression can be evaluated from many threads, each with its own frame. */
+double te_eval_frame(const te_expr *n, const double *frame);
+
+/* Evaluates the expression for count rows, writing the results to out. */
+/* The variable variables[i] given to te_compile reads columns[i][row]. */
+/* With AVX2 or AVX-512, exp, ln, log10, sin, cos and pow use vector */
+/* kernels within 1 ulp of the exact result. libm may be up to 2 ulp */
+/* off, so each call may differ from te_eval by 1-2 ulp, and the */
+/* differences compound through the rest of the expression. After */
+/* te_set_batch_isa(TE_ISA_SCALAR) results are bit-identical to te_eval. */
+void te_eval_batch(const te_expr *n, const double *const *columns, size_t count, double *out);
+
+/* Instruction sets for te_eval_batch arithmetic (see TE_SIMD). */
+enum {TE_ISA_SCALAR, TE_ISA_SSE2, TE_ISA_AVX2, TE_ISA_AVX512};
+
+/* Returns the instruction set used by te_eval_batch. */
+/* Defaults to the widest one supported by the host CPU, picked once by */
+/* whichever thread evaluates a batch first. */
+int te_batch_isa(void);
+
+/* Uses the widest supported instruction set not above isa. */
+/* TE_ISA_SCALAR selects the reference kernels. Returns the choice. */
+/* Not thread-safe: it must not run while any thread or pool is */
+/* evaluating a batch. */
+int te_set_batch_isa(int isa);
+
+
+typedef struct te_pool te_pool;
+
+/* Starts a pool of worker threads (builds with TE_THREADS). */
+/* threads <= 0 uses one per CPU; pin binds each worker to a CPU. */
+/* Other builds evaluate on the calling thread. Returns NULL on error. */
+te_pool *te_pool_create(int threads, int pin);
+
+/* Returns the number of threads evaluating, the caller included. */
+int te_pool_threads(const te_pool *pool);
+
+/* Reductions for te_eval_batch_parallel. */
+enum {TE_REDUCE_NONE, TE_REDUCE_SUM, TE_REDUCE_MIN, TE_REDUCE_MAX};
+
+/* Evaluates count rows like te_eval_batch, split across the pool. */
+/* n is only read, so any number of pools may share it. out may be NULL */
+/* when only the reduction is wanted. A NULL pool uses the calling thread. */
+/* Returns the reduction, bit-identical for any thread count, or NaN. */
+double te_eval_batch_parallel(te_pool *pool, const te_expr *n, const double *const *columns,
+        size_t count, double *out, int reduce);
+
+/* Stops the workers and frees the pool. */
+/* This is safe to call on NULL pointers. */
+void te_pool_free(te_pool *pool);
+
+/* Returns the number of nodes in n, counting shared subtrees once per use. */
+/* unique, when not NULL, receives the number of distinct nodes; the */
+/* difference is what TE_OPT_CSE saved by merging common subexpressions. */
+size_t te_node_count(const te_expr *n, size_t *unique);
+
+/* Returns the bytes of node memory in n, counting shared nodes once. */
+/* Allocator overhead per node comes on top. */
+size_t te_node_bytes(const te_expr *n);
+
+/* Moves n, compiled with malloc, into one allocation with its nodes in */
+/* evaluation order, children just before their parents, and frees n. */
+/* The result works with every function taking a te_expr, te_free included. */
+/* Returns NULL on error, leaving n untouched. */
+te_expr *te_compact(te_expr *n);
+
+typedef struct te_intern te_intern;
+
+/* Creates a table for sharing equal pure subtrees between expressions. */
+/* Not thread-safe: intern into a table and free the expressions using it */
+/* from one thread at a time. Returns NULL on error. */
+te_intern *te_intern_create(void);
+
+/* Merges the pure subtrees of n, compiled with malloc, into equal ones */
+/* already in the table, adding the others. Returns n or the expression */
+/* it became, to be freed with te_free as usual. */
+te_expr *te_intern_expr(te_intern *table, te_expr *n);
+
+/* Frees the nodes no expression uses anymore. Returns how many. */
+size_t te_intern_purge(te_intern *table);
+
+/* Reports the nodes held and the references to them from expressions */
+/* and other nodes. Any pointer may be NULL. */
+void te_intern_stats(const te_intern *table, size_t *nodes, size_t *uses);
+
+/* Frees the table. Expressions still using its nodes remain valid. */
+/* This is safe to call on NULL pointers. */
+void te_intern_free(te_intern *table);
+
+typedef struct te_cache te_cache;
+
+/* Creates a cache of up to capacity compiled expressions. */
+/* Lookups are thread-safe in builds with TE_THREADS. Returns NULL on error. */
+te_cache *te_cache_create(int capacity);
+
+/* Returns the expression compiled with te_compile_env, from the cache when */
+/* the same text, up to whitespace, was compiled with the same env before. */
+/* env may be NULL and must outlive the cache. The expression stays valid */
+/* until given to te_cache_release. Returns NULL on error. */
+const te_expr *te_cache_get(te_cache *cache, const char *expression, const te_env *env, int *error);
+
+/* Releases an expression returned by te_cache_get. */
+/* This is safe to call on NULL pointers. */
+void te_cache_release(te_cache *cache, const te_expr *n);
+
+/* Same as te_interp, skipping the parse when the expression is cached. */
+double te_cache_interp(te_cache *cache, const char *expression, int *error);
+
+/* Reports cache hits, misses and evictions. Any pointer may be NULL. */
+void te_cache_stats(te_cache *cache, unsigned long *hits, unsigned long *misses, unsigned long *evictions);
+
+/* Frees the cache and every expression in it. */
+/* This is safe to call on NULL pointers. */
+void te_cache_free(te_cache *cache);
+
+/* Writes a portable image of n to buffer, which may be NULL to get the */
+/* size. Variables and user functions are stored by name and must be in */
+/* env, which may be NULL when there are none. Returns the image size */
+/* (not written if it exceeds size), or 0 if n cannot be stored. */
+size_t te_serialize(const te_expr *n, const te_env *env, void *buffer, size_t size);
+
+/* Rebuilds an expression from te_serialize, binding names through env. */
+/* Returns NULL on error, setting error to the byte offset (1-based) of */
+/* the bad record or -1 if an allocation failed. */
+te_expr *te_deserialize(const void *data, size_t size, const te_env *env, int *error);
+
+typedef struct te_image te_image;
+
+/* Compiles the expressions with env and writes them to an image file */
+/* indexed by their text. Expressions that fail to compile are skipped. */
+/* Returns the number stored, or -1 on error. */
+int te_image_save(const char *path, const char *const *expressions, int count, const te_env *env);
+
+/* Opens an image file, mapping it with mmap in builds with TE_MMAP. */
+/* Returns NULL on error. */
+te_image *te_image_open(const char *path);
+
+/* Returns the stored expression with the same text, up to whitespace, */
+/* bound through env. Returns NULL with error 0 if it is not in the image. */
+te_expr *te_image_load(const te_image *image, const char *expression, const te_env *env, int *error);
+
+/* Closes the image. Loaded expressions remain valid. */
+/* This is safe to call on NULL pointers. */
+void te_image_close(te_image *image);
+
 /* Prints debugging information on the syntax tree. */
 void te_print(const te_expr *n);
 
@@ -79,6 +325,86 @@ void te_print(const te_expr *n);
 /* This is safe to call on NULL pointers. */
 void te_free(te_expr *n);
 
+/* Frees an expression compiled with te_compile_ex and the same allocator. */
+/* This is safe to call on NULL pointers. */
+void te_free_ex(te_expr *n, const te_allocator *allocator);
+
+
+typedef struct te_arena te_arena;
+
+/* Creates a bump-pointer arena taking chunk bytes at a time from malloc */
+/* (4096 when 0). Not thread-safe: use one arena per thread. */
+/* Returns NULL on error. */
+te_arena *te_arena_create(size_t chunk);
+
+/* Creates an arena inside buffer, which must be aligned for double. */
+/* It never calls malloc; compiling fails with error -1 once it is full. */
+/* Returns NULL if size cannot even hold the arena. */
+te_arena *te_arena_create_buffer(void *buffer, size_t size);
+
+/* Returns the allocator to pass to te_compile_ex. */
+const te_allocator *te_arena_allocator(te_arena *arena);
+
+/* Returns the bytes handed out since creation or the last reset. */
+size_t te_arena_used(const te_arena *arena);
+
+/* Releases every expression in the arena at once. */
+void te_arena_reset(te_arena *arena);
+
+/* Frees the arena and every expression in it. */
+/* This is safe to call on NULL pointers and on buffer arenas. */
+void te_arena_free(te_arena *arena);
+
+
+typedef struct te_program te_program;
+
+/* Flattens the expression into a postfix program. */
+/* The program does not reference n, which may be freed afterwards. */
+/* Returns NULL on error. */
+te_program *te_program_compile(const te_expr *n);
+
+/* Evaluates the program. Returns the same value as te_eval. */
+double te_program_eval(const te_program *p);
+
+/* Frees the program. */
+/* This is safe to call on NULL pointers. */
+void te_program_free(te_program *p);
+
+
+typedef struct te_packed te_packed;
+
+/* Copies the expression into one block of 12-byte nodes linked by 32-bit */
+/* indices, with functions and closure contexts in a separate table. */
+/* The result does not reference n. Returns NULL on error. */
+te_packed *te_pack(const te_expr *n);
+
+/* Evaluates the packed expression. Returns the same value as te_eval. */
+double te_packed_eval(const te_packed *p);
+
+/* Returns the bytes allocated for the packed expression. */
+size_t te_packed_size(const te_packed *p);
+
+/* Frees the packed expression. */
+/* This is safe to call on NULL pointers. */
+void te_packed_free(te_packed *p);
+
+
+typedef struct te_jit te_jit;
+
+/* Compiles the expression to native code (x86-64 builds with TE_JIT). */
+/* Other builds, and expressions whose operands nest too deep for a */
+/* small native stack frame, evaluate n through te_eval. n must outlive */
+/* the result. */
+/* Returns NULL on error. */
+te_jit *te_jit_compile(const te_expr *n);
+
+/* Evaluates the compiled code. Returns the same value as te_eval. */
+double te_jit_eval(const te_jit *j);
+
+/* Frees the compiled code. */
+/* This is safe to call on NULL pointers. */
+void te_jit_free(te_jit *j);
+
 
 #ifdef __cplusplus
 }